@@ -0,0 +1,330 @@
+//
+// End-to-end latency bench. Runs a TuneSet on one end of a Linux pty pair and
+// drives it from the other end, measuring the round trip from a host write to
+// the echoed response.
+//
+// The device side uses the native backend (tuning_native.h). Build and run
+// from this directory:
+//      g++ -std=c++17 -O2 -pthread -I../.. latency-bench.cpp -o latency-bench
+//      ./latency-bench --baud 115200 --items 32 --ops 1000
+//
+// Options:
+//      --baud N        Baud rate to pace host writes at (0 = unpaced). Default: 115200.
+//      --items N       Number of float items registered on the device. Default: 16.
+//      --ops N         Operations per workload. Default: 500.
+//      --batch N       Commands per batch operation. Default: 8.
+//      --loop-us N     Sleep between read() calls on the device. Default: 0.
+//      --ids           Address items as "#id" instead of by label.
+//      --workloads L   Comma-separated workloads to run: get,set,batch,dump. Default: all.
+//      --mix M         Additionally run a weighted mix, e.g. "get:6,set:3,dump:1".
+//
+// Workloads:
+//      get     "p3"                    -> "p3=..."
+//      set     "p3=1.5\np3"            -> "p3=1.500000" (the applied value)
+//      batch   N sets and N gets in one write -> N lines
+//      dump    "changed"               -> one line per item + "changed=<gen>"
+//
+// Host writes are delayed by the time the command would take on the wire at
+// the given baud rate (10 bits per byte). The device's responses travel over
+// the pty unpaced, so their modelled wire time is added to each sample.
+//
+
+#include "tuning.h"
+
+#include <fcntl.h>
+#include <poll.h>
+#include <termios.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <iterator>
+#include <random>
+#include <thread>
+#include <vector>
+
+
+namespace
+{
+    using Clock = std::chrono::steady_clock;
+
+    // How long to wait for each response chunk before failing the sample.
+    constexpr int ResponseTimeoutMs = 1000;
+
+    const char* const Workloads[] = {"get", "set", "batch", "dump"};
+
+    struct Options
+    {
+        unsigned long baud = 115200;
+        size_t items = 16;
+        size_t ops = 500;
+        size_t batch = 8;
+        unsigned long loopUs = 0;
+        bool ids = false;
+        std::string workloads = "get,set,batch,dump";
+        std::string mix;
+    };
+
+    struct Command
+    {
+        std::string text;
+        size_t lines; // Number of response lines to wait for.
+    };
+
+    TuneSet<64> tuning;
+    float values[64];
+    FdStream port;
+    std::atomic<bool> running{true};
+
+
+    void device(unsigned long loopUs)
+    {
+        while (running) {
+            tuning.read(port);
+            if (loopUs)
+                usleep(loopUs);
+        }
+    }
+
+
+    class Host
+    {
+    public:
+        Host(int fd, const Options& options) : m_fd{fd}, m_options{options}, m_rng{42} {}
+
+        Command make(const std::string& workload)
+        {
+            std::string cmd;
+            size_t lines = 1;
+            if (workload == "get") {
+                cmd = key() + "\n";
+            } else if (workload == "set") {
+                std::string k = key();
+                cmd = k + "=" + value() + "\n" + k + "\n";
+            } else if (workload == "batch") {
+                for (size_t i = 0; i < m_options.batch; i++) {
+                    std::string k = key();
+                    cmd += k + "=" + value() + "\n" + k + "\n";
+                }
+                lines = m_options.batch;
+            } else if (workload == "dump") {
+                cmd = "changed\n";
+                lines = m_options.items + 1;
+            }
+            return Command{cmd, lines};
+        }
+
+        // Returns the round-trip time in microseconds.
+        double run(const Command& cmd)
+        {
+            Clock::time_point start = Clock::now();
+            if (m_options.baud)
+                std::this_thread::sleep_for(wireTime(cmd.text.size()));
+            if (::write(m_fd, cmd.text.data(), cmd.text.size()) != static_cast<ssize_t>(cmd.text.size()))
+                return -1;
+
+            size_t lines = 0, bytes = 0;
+            while (lines < cmd.lines) {
+                pollfd pfd{m_fd, POLLIN, 0};
+                if (::poll(&pfd, 1, ResponseTimeoutMs) <= 0)
+                    return -1;
+
+                char buffer[512];
+                ssize_t n = ::read(m_fd, buffer, sizeof(buffer));
+                if (n <= 0)
+                    return -1;
+                bytes += n;
+                lines += std::count(buffer, buffer + n, '\n');
+            }
+            Clock::duration elapsed = Clock::now() - start;
+            if (m_options.baud)
+                elapsed += wireTime(bytes);
+            return std::chrono::duration<double, std::micro>(elapsed).count();
+        }
+
+    private:
+        std::string key()
+        {
+            size_t i = m_rng() % m_options.items;
+            return (m_options.ids ? "#" : "p") + std::to_string(i);
+        }
+
+        std::string value()
+        {
+            char buffer[16];
+            snprintf(buffer, sizeof(buffer), "%.3f", (m_rng() % 100000) / 1000.0);
+            return buffer;
+        }
+
+        Clock::duration wireTime(size_t bytes) const
+        {
+            return std::chrono::duration_cast<Clock::duration>(
+                std::chrono::duration<double>(bytes * 10.0 / m_options.baud));
+        }
+
+        int m_fd;
+        const Options& m_options;
+        std::minstd_rand m_rng;
+    };
+
+
+    std::vector<std::string> split(const std::string& s, char delimiter)
+    {
+        std::vector<std::string> parts;
+        size_t begin = 0;
+        while (begin <= s.size()) {
+            size_t end = s.find(delimiter, begin);
+            if (end == std::string::npos)
+                end = s.size();
+            if (end > begin)
+                parts.push_back(s.substr(begin, end - begin));
+            begin = end + 1;
+        }
+        return parts;
+    }
+
+    // Operations run back to back, so throughput follows from the total (modelled) round-trip time.
+    void report(const std::string& name, std::vector<double>& samples)
+    {
+        if (samples.empty()) {
+            printf("%-8s  no samples\n", name.c_str());
+            return;
+        }
+        double total = 0;
+        for (double us : samples)
+            total += us;
+        std::sort(samples.begin(), samples.end());
+        auto pct = [&](double p) { return samples[std::min(samples.size() - 1, size_t(p * samples.size()))]; };
+        printf("%-8s %8zu %10.1f %10.1f %10.1f %10.1f %10.1f\n", name.c_str(), samples.size(), pct(0.50), pct(0.90),
+               pct(0.99), samples.back(), samples.size() * 1e6 / total);
+    }
+
+    void bench(Host& host, const std::string& name, const std::vector<std::pair<std::string, unsigned>>& mix,
+               size_t ops)
+    {
+        unsigned total = 0;
+        for (auto& m : mix)
+            total += m.second;
+
+        std::minstd_rand rng{7};
+        std::vector<double> samples;
+        samples.reserve(ops);
+        for (size_t i = 0; i < ops; i++) {
+            unsigned pick = rng() % total;
+            size_t w = 0;
+            while (pick >= mix[w].second)
+                pick -= mix[w++].second;
+
+            double us = host.run(host.make(mix[w].first));
+            if (us < 0) {
+                fprintf(stderr, "%s: pty I/O failed or timed out\n", name.c_str());
+                break;
+            }
+            samples.push_back(us);
+        }
+        report(name, samples);
+    }
+
+    bool known(const std::string& workload)
+    {
+        return std::find(std::begin(Workloads), std::end(Workloads), workload) != std::end(Workloads);
+    }
+
+    bool parse(int argc, char** argv, Options& options)
+    {
+        for (int i = 1; i < argc; i++) {
+            std::string arg = argv[i];
+            bool hasValue = i + 1 < argc;
+            if (arg == "--ids")
+                options.ids = true;
+            else if (arg == "--baud" && hasValue)
+                options.baud = strtoul(argv[++i], nullptr, 0);
+            else if (arg == "--items" && hasValue)
+                options.items = strtoul(argv[++i], nullptr, 0);
+            else if (arg == "--ops" && hasValue)
+                options.ops = strtoul(argv[++i], nullptr, 0);
+            else if (arg == "--batch" && hasValue)
+                options.batch = strtoul(argv[++i], nullptr, 0);
+            else if (arg == "--loop-us" && hasValue)
+                options.loopUs = strtoul(argv[++i], nullptr, 0);
+            else if (arg == "--workloads" && hasValue)
+                options.workloads = argv[++i];
+            else if (arg == "--mix" && hasValue)
+                options.mix = argv[++i];
+            else
+                return false;
+        }
+
+        for (const std::string& w : split(options.workloads, ',')) {
+            if (!known(w))
+                return false;
+        }
+        for (const std::string& part : split(options.mix, ',')) {
+            if (!known(part.substr(0, part.find(':'))))
+                return false;
+        }
+        return options.items > 0 && options.items <= 64 && options.batch > 0;
+    }
+} // namespace
+
+
+int main(int argc, char** argv)
+{
+    Options options;
+    if (!parse(argc, argv, options)) {
+        fprintf(stderr, "usage: %s [--baud N] [--items N<=64] [--ops N] [--batch N] [--loop-us N] [--ids]\n"
+                        "          [--workloads get,set,batch,dump] [--mix get:6,set:3,dump:1]\n",
+                argv[0]);
+        return 2;
+    }
+
+    int master = posix_openpt(O_RDWR | O_NOCTTY);
+    if (master < 0 || grantpt(master) || unlockpt(master)) {
+        perror("posix_openpt");
+        return 1;
+    }
+    int slave = open(ptsname(master), O_RDWR | O_NOCTTY);
+    if (slave < 0) {
+        perror("open slave");
+        return 1;
+    }
+
+    // No echo, no newline translation: bytes pass through as on a UART.
+    termios tio;
+    tcgetattr(slave, &tio);
+    cfmakeraw(&tio);
+    tcsetattr(slave, TCSANOW, &tio);
+
+    for (size_t i = 0; i < options.items; i++)
+        tuning.add(String("p") + String(i), values[i]);
+    port.begin(slave);
+
+    std::thread thread{device, options.loopUs};
+
+    printf("baud=%lu items=%zu batch=%zu addressing=%s\n", options.baud, options.items, options.batch,
+           options.ids ? "id" : "label");
+    printf("%-8s %8s %10s %10s %10s %10s %10s\n", "workload", "ops", "p50(us)", "p90(us)", "p99(us)", "max(us)",
+           "ops/s");
+
+    Host host{master, options};
+    for (const std::string& w : split(options.workloads, ','))
+        bench(host, w, {{w, 1}}, options.ops);
+
+    if (!options.mix.empty()) {
+        std::vector<std::pair<std::string, unsigned>> mix;
+        for (const std::string& part : split(options.mix, ',')) {
+            size_t colon = part.find(':');
+            unsigned weight = colon == std::string::npos ? 1 : strtoul(part.c_str() + colon + 1, nullptr, 0);
+            if (weight)
+                mix.emplace_back(part.substr(0, colon), weight);
+        }
+        if (!mix.empty())
+            bench(host, "mix", mix, options.ops);
+    }
+
+    running = false;
+    thread.join();
+    close(slave);
+    close(master);
+    return 0;
+}
@@ -11,7 +11,18 @@
 #include "tuning_profile.h"
 #endif
 
+// Without the Arduino core (e.g. in a simulator on Linux), fall back to the native backend.
+#if !defined(SERIAL_TUNING_NATIVE) && defined(__has_include)
+#if !__has_include(<Arduino.h>)
+#define SERIAL_TUNING_NATIVE
+#endif
+#endif
+
+#ifdef SERIAL_TUNING_NATIVE
+#include "tuning_native.h"
+#else
 #include <Arduino.h>
+#endif
 
 #ifdef SERIAL_TUNING_USE_ETL_UNORDERED_MAP
 #ifdef SERIAL_TUNING_IS_ARDUINO
@@ -21,7 +32,11 @@
 #else
 #include <array>
 #endif
+#include <cmath>
+#include <cstddef>
 #include <cstdlib>
+#include <cstring>
+#include <limits>
 #include <type_traits>
 
 
@@ -33,6 +48,18 @@
 #define SERIAL_TUNING_OUTPUT_FORMAT "%s=%s\n"
 #endif
 
+#ifndef SERIAL_TUNING_UPLOAD_TIMEOUT
+#define SERIAL_TUNING_UPLOAD_TIMEOUT 1000
+#endif
+
+#ifndef SERIAL_TUNING_MAX_RAMPS
+#define SERIAL_TUNING_MAX_RAMPS 4
+#endif
+
+#ifndef SERIAL_TUNING_SCHEMA_FORMAT
+#define SERIAL_TUNING_SCHEMA_FORMAT "%u,%s,%s,%s,%s\n"
+#endif
+
 
 // Use an x-macro to avoid repetition/typos.
 #ifndef SERIAL_TUNING_TYPE_LIST
@@ -107,7 +134,7 @@ public:
     static String write(T value)
     {
         char buffer[32];
-        snprintf(buffer, sizeof(buffer), "%llu", value);
+        snprintf(buffer, sizeof(buffer), "%llu", static_cast<unsigned long long>(value));
         return String(buffer);
     }
 
@@ -115,7 +142,7 @@ public:
     static String write(T value)
     {
         char buffer[32];
-        snprintf(buffer, sizeof(buffer), "%lld", value);
+        snprintf(buffer, sizeof(buffer), "%lld", static_cast<long long>(value));
         return String(buffer);
     }
 
@@ -144,6 +171,63 @@ enum Type
 #define X_ENUM(T) ENUMIFY(T),
     SERIAL_TUNING_TYPE_LIST(X_ENUM)
 #undef X_ENUM
+    TUNING_TYPE_STRUCT,
+    TUNING_TYPE_BLOB,
+};
+
+
+namespace detail
+{
+    /**
+     * Maps a tunable type to its Type enumerator.
+     */
+    template <typename T>
+    struct type_of;
+
+#define X_TYPE_OF(T)                              \
+    template <>                                   \
+    struct type_of<T>                             \
+    {                                             \
+        static constexpr Type value = ENUMIFY(T); \
+    };
+
+    SERIAL_TUNING_TYPE_LIST(X_TYPE_OF)
+
+#undef X_TYPE_OF
+} // namespace detail
+
+
+/**
+ * Describes one field of a struct: its name, byte offset, and type. Build
+ * these with TUNE_FIELD.
+ */
+struct TuneField
+{
+    const char* name;
+    size_t offset;
+    Type type;
+};
+
+
+/**
+ * Describes the tunable fields of a struct. Declare these as constants with
+ * TUNE_STRUCT, so that the field table stays out of RAM where possible.
+ */
+struct TuneStruct
+{
+    const TuneField* fields;
+    size_t count;
+};
+
+
+/**
+ * A TuneStruct which describes struct S, so that it can only be added with
+ * instances of S.
+ */
+template <typename S>
+struct TuneStructOf : TuneStruct
+{
+    constexpr TuneStructOf(const TuneField* fields, size_t count) : TuneStruct{fields, count} {}
 };
 
 
@@ -155,9 +239,18 @@ class TuneItem
 public:
     Type type;
     void* data = nullptr;
+    union
+    {
+        const TuneStruct* layout = nullptr; // Only used by structs.
+        size_t size;                        // Only used by blobs.
+    };
 
     TuneItem() = default;
 
+    TuneItem(void* instance, const TuneStruct& layout) : type{TUNING_TYPE_STRUCT}, data{instance}, layout{&layout} {}
+
+    TuneItem(void* buffer, size_t size) : type{TUNING_TYPE_BLOB}, data{buffer}, size{size} {}
+
 #define X_CONSTRUCTOR(T) \
     TuneItem(T& data) : type{ENUMIFY(T)}, data{reinterpret_cast<void*>(&data)} {}
 
@@ -203,6 +296,156 @@ namespace detail
             return text.substring(index);
         }
     };
+
+    /**
+     * A value moving towards a target over time. See TuneSet::tick().
+     */
+    struct Ramp
+    {
+        int id = -1; // The item being ramped, or -1 if this slot is free.
+        Type type;
+        void* data;
+        double from;
+        double to;
+        unsigned long start;
+        unsigned long duration;
+        bool exponential;
+    };
+
+    /**
+     * CRC-32 (the same as zlib's crc32). Pass the previous result as `crc` to
+     * continue a checksum over multiple chunks.
+     */
+    inline uint32_t crc32(const uint8_t* data, size_t size, uint32_t crc = 0)
+    {
+        crc = ~crc;
+        while (size--) {
+            crc ^= *data++;
+            for (int i = 0; i < 8; i++)
+                crc = (crc >> 1) ^ (0xEDB88320 & (0 - (crc & 1)));
+        }
+        return ~crc;
+    }
+
+    /**
+     * Writes an incoming blob straight into its destination buffer, keeping a
+     * running checksum. Payloads are either raw bytes, or base64 characters
+     * which are decoded as they arrive.
+     */
+    class BlobUpload
+    {
+    public:
+        void begin(int id, uint8_t* data, size_t size, uint32_t checksum)
+        {
+            m_id = id;
+            m_data = data;
+            m_size = size;
+            m_received = 0;
+            m_crc = 0;
+            m_expected = checksum;
+            m_bits = 0;
+            m_numBits = 0;
+        }
+
+        void end()
+        {
+            m_id = -1;
+        }
+
+        bool active() const
+        {
+            return m_id >= 0;
+        }
+
+        int id() const
+        {
+            return m_id;
+        }
+
+        bool complete() const
+        {
+            return m_received == m_size;
+        }
+
+        size_t size() const
+        {
+            return m_size;
+        }
+
+        size_t received() const
+        {
+            return m_received;
+        }
+
+        size_t remaining() const
+        {
+            return m_size - m_received;
+        }
+
+        uint32_t checksum() const
+        {
+            return m_crc;
+        }
+
+        bool valid() const
+        {
+            return complete() && m_crc == m_expected;
+        }
+
+        /**
+         * Where the next raw bytes should be written. Call commit() after.
+         */
+        uint8_t* cursor()
+        {
+            return m_data + m_received;
+        }
+
+        void commit(size_t n)
+        {
+            m_crc = crc32(cursor(), n, m_crc);
+            m_received += n;
+        }
+
+        /**
+         * Decodes one base64 character (standard or URL-safe alphabet).
+         * Padding, whitespace and other characters are skipped.
+         */
+        void decode(char c)
+        {
+            int v;
+            if ('A' <= c && c <= 'Z')
+                v = c - 'A';
+            else if ('a' <= c && c <= 'z')
+                v = c - 'a' + 26;
+            else if ('0' <= c && c <= '9')
+                v = c - '0' + 52;
+            else if (c == '+' || c == '-')
+                v = 62;
+            else if (c == '/' || c == '_')
+                v = 63;
+            else
+                return;
+
+            m_bits = (m_bits << 6) | v;
+            m_numBits += 6;
+            if (m_numBits >= 8 && !complete()) {
+                m_numBits -= 8;
+                *cursor() = m_bits >> m_numBits;
+                m_bits &= (1u << m_numBits) - 1;
+                commit(1);
+            }
+        }
+
+    private:
+        int m_id = -1;
+        uint8_t* m_data = nullptr;
+        size_t m_size = 0;
+        size_t m_received = 0;
+        uint32_t m_crc = 0;
+        uint32_t m_expected = 0;
+        uint32_t m_bits = 0;
+        uint8_t m_numBits = 0;
+    };
 } // namespace detail
 
 #ifdef SERIAL_TUNING_USE_ETL_UNORDERED_MAP
@@ -229,24 +472,52 @@ namespace detail
     class container
     {
     public:
-        void insert(const String& label, const TuneItem& item)
+        int insert(const String& label, const TuneItem& item)
         {
-            if (m_items.size() == MAX_ITEMS)
-                return;
-            m_items[label] = item;
+            auto it = m_ids.find(label);
+            if (it != m_ids.end()) {
+                m_items[it->second] = item;
+                return it->second;
+            }
+
+            if (m_size == MAX_ITEMS)
+                return -1;
+            it = m_ids.insert(etl::make_pair(label, m_size)).first;
+            m_labels[m_size] = &it->first;
+            m_items[m_size] = item;
+            return m_size++;
+        }
+
+        int find(const String& label) const
+        {
+            auto it = m_ids.find(label);
+            if (it != m_ids.end())
+                return it->second;
+
+            return -1;
+        }
+
+        TuneItem* get(size_t id)
+        {
+            return id < m_size ? &m_items[id] : nullptr;
         }
 
-        TuneItem* get(const String& label)
+        const String& label(size_t id) const
         {
-            auto it = m_items.find(label);
-            if (it != m_items.end())
-                return &it->second;
+            return *m_labels[id];
+        }
 
-            return nullptr;
+        size_t size() const
+        {
+            return m_size;
         }
 
     private:
-        etl::unordered_map<String, TuneItem, MAX_ITEMS> m_items;
+        // Labels are kept in the map's nodes; IDs index into the flat arrays.
+        etl::unordered_map<String, size_t, MAX_ITEMS> m_ids;
+        const String* m_labels[MAX_ITEMS];
+        TuneItem m_items[MAX_ITEMS];
+        size_t m_size = 0;
     };
 } // namespace detail
 
@@ -258,29 +529,44 @@ namespace detail
     class container
     {
     public:
-        void insert(const String& label, const TuneItem& item)
+        int insert(const String& label, const TuneItem& item)
         {
             if (m_size == MAX_ITEMS)
-                return;
+                return -1;
             m_labels[m_size] = label;
             m_items[m_size] = item;
-            m_size++;
+            return m_size++;
         }
 
-        TuneItem* get(const String& label)
+        int find(const String& label) const
         {
             for (size_t i = 0; i < m_size; i++) {
                 if (m_labels[i] == label) {
-                    return &m_items[i];
+                    return i;
                 }
             }
-            return nullptr;
+            return -1;
+        }
+
+        TuneItem* get(size_t id)
+        {
+            return id < m_size ? &m_items[id] : nullptr;
+        }
+
+        const String& label(size_t id) const
+        {
+            return m_labels[id];
+        }
+
+        size_t size() const
+        {
+            return m_size;
         }
 
     private:
         String m_labels[MAX_ITEMS];
         TuneItem m_items[MAX_ITEMS];
-        size_t m_size;
+        size_t m_size = 0;
     };
 } // namespace detail
 
@@ -297,16 +583,103 @@ class TuneSet
     detail::container<MAX_ITEMS> m_container;
     Callback m_onSetCallback = nullptr;
 
+    // Each item is stamped with the generation at which it last changed.
+    uint32_t m_generation = 0;
+    uint32_t m_changed[MAX_ITEMS] = {};
+#ifdef SERIAL_TUNING_SHADOW_COPY
+    uint64_t m_shadow[MAX_ITEMS] = {};
+#endif
+
+    detail::BlobUpload m_upload;
+    Print* m_uploadClient = nullptr; // Where the upload is coming from, and where replies go.
+    unsigned long m_uploadTime = 0;  // Time at which upload data was last received.
+
+    detail::Ramp m_ramps[SERIAL_TUNING_MAX_RAMPS];
+
+    /**
+     * A resolved command target: an item, or a field of a struct item.
+     */
+    struct Ref
+    {
+        int id = -1;
+        Type type;
+        void* data = nullptr;
+        const TuneStruct* layout = nullptr;
+        size_t size = 0;
+    };
+
 public:
     /**
      * @brief   Adds a tuning variable with an associated label and variable.
      *          Anytime we want to refer this variable from Serial, you would
-     *          use its label.
+     *          use its label, or its numeric ID prefixed with '#'.
+     *
+     * @return  The item's ID (its registration index), or -1 if the set is
+     *          full.
      */
     template <typename T>
-    void add(String label, T& data)
+    int add(String label, T& data)
+    {
+        return insert(label, TuneItem(data));
+    }
+
+    /**
+     * @brief   Adds a struct instance as a single item. Its fields are
+     *          described by `layout` (see TUNE_STRUCT), which must have been
+     *          declared for S, and are referred to as "label.field". See
+     *          README for examples.
+     *
+     * @return  The item's ID, or -1 if the set is full.
+     */
+    template <typename S>
+    int add(String label, S& instance, const TuneStructOf<S>& layout)
     {
-        m_container.insert(label, TuneItem(data));
+        return insert(label, TuneItem(reinterpret_cast<void*>(&instance), layout));
+    }
+
+    /**
+     * @brief   Adds an array as a blob: a raw buffer which is uploaded in bulk
+     *          with "label<length,crc32" rather than set with text values.
+     *          See README for the upload protocol. Only arrays of numbers
+     *          can be added, since their bytes are overwritten directly.
+     */
+    template <typename T, size_t N, ENABLE_IF(std::is_arithmetic<T>::value)>
+    int add(String label, T (&array)[N])
+    {
+        return addBlob(label, array, sizeof(array));
+    }
+
+    /**
+     * @brief   Adds a buffer of `size` bytes as a blob.
+     */
+    int addBlob(String label, void* buffer, size_t size)
+    {
+        return insert(label, TuneItem(buffer, size));
+    }
+
+    /**
+     * @brief   Marks an item as changed, so that it's reported by the
+     *          "changed" command. Call this after the firmware modifies a
+     *          tuning variable by itself. Sets through commands are tracked
+     *          automatically.
+     */
+    void markChanged(int id)
+    {
+        if (id < 0 || static_cast<size_t>(id) >= m_container.size())
+            return;
+        m_changed[id] = ++m_generation;
+#ifdef SERIAL_TUNING_SHADOW_COPY
+        snapshot(*m_container.get(id), m_shadow[id]);
+#endif
+    }
+
+    /**
+     * @brief   The current generation number. This increases whenever an item
+     *          changes.
+     */
+    uint32_t generation() const
+    {
+        return m_generation;
     }
 
     /**
@@ -319,73 +692,840 @@ public:
         m_onSetCallback = callback;
     }
 
+    /**
+     * @brief   Advances active ramps (see "label~value@duration"), and times
+     *          out stalled uploads. This is called by readSerial() and
+     *          read(stream), but can also be called on its own, e.g. from a
+     *          control loop.
+     */
+    void tick()
+    {
+        unsigned long now = millis();
+        if (m_upload.active() && now - m_uploadTime > SERIAL_TUNING_UPLOAD_TIMEOUT) {
+#ifdef SERIAL_TUNING_WARN_INVALID
+            m_uploadClient->println("[TuneSet] error: upload to '" + m_container.label(m_upload.id()) + "' timed out");
+#endif
+            abortUpload();
+        }
+
+        for (detail::Ramp& ramp : m_ramps) {
+            if (ramp.id < 0)
+                continue;
+
+            unsigned long elapsed = now - ramp.start;
+            double value = ramp.to;
+            if (elapsed < ramp.duration) {
+                double t = static_cast<double>(elapsed) / ramp.duration;
+                if (ramp.exponential) {
+                    // First-order approach with a time constant of 1/5 of the duration, scaled to end on target.
+                    t = (1 - exp(-5 * t)) / (1 - exp(-5.0));
+                }
+                value = ramp.from + (ramp.to - ramp.from) * t;
+            }
+            bool changed = set_number(ramp.type, ramp.data, value);
+
+            Ref ref = refer(ramp.id);
+            ref.data = ramp.data;
+            bool done = elapsed >= ramp.duration;
+            if (done)
+                ramp.id = -1;
+            // Between steps of an integer (or a slow ramp), there's nothing to report.
+            if (changed || done)
+                updated(ref);
+        }
+    }
+
     /**
      * @brief   Read commands from Serial.
      */
     void readSerial()
     {
-        while (Serial.available()) {
-            String line = Serial.readStringUntil('\n');
-            read(line);
+        read(Serial);
+    }
+
+    /**
+     * @brief   Read commands from a stream, such as another UART port. Output
+     *          is printed back to the same stream.
+     */
+    void read(Stream& stream)
+    {
+        // Time out a stalled upload first, so that new input isn't taken as its payload.
+        tick();
+        readCommands(stream);
+    }
+
+    /**
+     * @brief   Like read(stream), but without calling tick() first. Useful
+     *          when reading several streams per loop: call tick() once, then
+     *          this for each stream.
+     */
+    void readCommands(Stream& stream)
+    {
+        while (stream.available()) {
+            if (uploading(stream)) {
+                receive(stream);
+            } else {
+                String line = stream.readStringUntil('\n');
+                read(line, stream);
+            }
         }
     }
 
+    /**
+     * @brief   Whether a blob upload started by `client` is in progress. While
+     *          this is true, input from `client` is upload data.
+     */
+    bool uploading(const Print& client) const
+    {
+        return m_upload.active() && m_uploadClient == &client;
+    }
+
+    /**
+     * @brief   Abandons the upload started by `client`, if any. Call this when
+     *          the client goes away.
+     */
+    void cancelUpload(const Print& client)
+    {
+        if (uploading(client))
+            abortUpload();
+    }
+
     /**
      * @brief   Read commands directly from a string. We assume the string
      *          represents ONE line containing ONE command.
      *
      *          If the command follows "label=xyz", then the variable associated with `label` is set to `xyz`.
-     *          If the command follows "label", then the variable associated with `label` is printed to Serial.
+     *          If the command follows "label", then the variable associated with `label` is printed to `out`.
+     *          A label may also be given as "#id" (e.g. "#12=0.5"), which indexes the item directly.
+     *          If the command follows "label+=xyz", the variable is updated in place and its new value is printed.
+     *          Integers support += -= *= /= %= &= |= ^=, and floating-points support += -= *= /=.
+     *          Struct fields are referred to as "label.field". A struct is printed as one line per field, and can be
+     *          set in one line with comma-separated values (e.g. "pid=1,0,0.5").
+     *          If the command follows "label~xyz@500ms", the variable is ramped linearly to `xyz` over 500 ms (or
+     *          "@0.5s"). Append ",exp" to approach `xyz` exponentially instead. Ramps advance in tick(), and are
+     *          cancelled when the variable is set by another command.
+     *          The "label<length,crc32" command starts uploading `length` bytes into a blob. While the upload is
+     *          active, lines from the same `out` are decoded as base64 payload instead of commands.
+     *          The "schema" command prints the ID, label, type, and bounds of every item.
+     *          The "changed=gen" command prints items changed since generation `gen`, then the current generation.
      *          You can customise the print format and logging options in your tuning_profile.h.
      */
-    void read(String s)
+    void read(String s, Print& out = Serial)
     {
+#ifndef SERIAL_TUNING_BLOB_RAW
+        if (uploading(out)) {
+            for (char c : s)
+                m_upload.decode(c);
+            m_uploadTime = millis();
+            if (m_upload.complete())
+                finishUpload();
+            return;
+        }
+#endif
+
         detail::StringReader reader{s};
         String label = reader.readUntil('=');
         String value = reader.rest();
 #ifdef SERIAL_TUNING_LOG_PARSE_RESULT
-        Serial.printf("[TuneSet] parsed '%s' --> label='%s', value='%s'\n", s.c_str(), label.c_str(), value.c_str());
+        out.printf("[TuneSet] parsed '%s' --> label='%s', value='%s'\n", s.c_str(), label.c_str(), value.c_str());
 #endif
         if (!label.isEmpty()) {
-            TuneItem* item = m_container.get(label);
-            if (!item) {
+            Ref ref;
+            char op = 0;
+            if (!resolve(label, ref) && !value.isEmpty() && is_operator(label[label.length() - 1])) {
+                // "label+=xyz" was split as "label+" and "xyz".
+                String target = label.substring(0, label.length() - 1);
+                if (resolve(target, ref)) {
+                    op = label[label.length() - 1];
+                    label = target;
+                }
+            }
+
+            if (ref.id < 0) {
+                if (label.indexOf('<') > 0) {
+                    upload(label, out);
+                    return;
+                }
+                if (label.indexOf('~') > 0) {
+                    startRamp(label, out);
+                    return;
+                }
+                if (command(label, value, out))
+                    return;
 #ifdef SERIAL_TUNING_WARN_NOT_FOUND
-                Serial.println("[TuneSet] error: could not find variable '" + label + "'");
+                out.println("[TuneSet] error: could not find variable '" + label + "'");
+#endif
+            } else if (op) {
+                if (!ref.layout && apply(ref.type, ref.data, op, value)) {
+                    cancelRamps(ref);
+                    updated(ref);
+                    print(label, ref, out);
+                } else {
+#ifdef SERIAL_TUNING_WARN_INVALID
+                    out.println("[TuneSet] error: cannot apply '" + String(op) + "=' to '" + label + "'");
+#endif
+                }
+            } else if (ref.type == TUNING_TYPE_BLOB && !value.isEmpty()) {
+#ifdef SERIAL_TUNING_WARN_INVALID
+                out.println("[TuneSet] error: '" + label + "' is a blob and can only be uploaded");
 #endif
             } else {
                 if (!value.isEmpty()) {
-                    set(*item, value);
-                    if (m_onSetCallback)
-                        m_onSetCallback(item->data);
+                    if (ref.layout)
+                        setFields(ref, value);
+                    else
+                        set(ref.type, ref.data, value);
+                    cancelRamps(ref);
+                    updated(ref);
                 } else {
-                    Serial.printf(SERIAL_TUNING_OUTPUT_FORMAT, label.c_str(), to_string(*item).c_str());
+                    print(label, ref, out);
                 }
             }
         }
     }
 
 private:
-    void set(TuneItem& item, const String& value)
+    int insert(const String& label, const TuneItem& item)
+    {
+        int id = m_container.insert(label, item);
+        if (id >= 0)
+            markChanged(id);
+        return id;
+    }
+
+    /**
+     * Looks up an item's ID by "#id" or by label. Returns -1 if not found.
+     * Labels which start with '#' but aren't a number are looked up as is.
+     */
+    int find(const String& label)
+    {
+        if (label[0] == '#') {
+            char* str_end;
+            unsigned long id = strtoul(label.c_str() + 1, &str_end, 10);
+            if (str_end != label.c_str() + 1 && *str_end == '\0')
+                return id < m_container.size() ? static_cast<int>(id) : -1;
+        }
+
+        return m_container.find(label);
+    }
+
+    /**
+     * Resolves "label", "#id", "label.field", or "#id.field". A full label
+     * match takes precedence, so labels containing '.' keep working.
+     */
+    bool resolve(const String& label, Ref& ref)
+    {
+        int id = find(label);
+        if (id >= 0) {
+            ref = refer(id);
+            return true;
+        }
+
+        int dot = label.indexOf('.');
+        if (dot < 0)
+            return false;
+        id = find(label.substring(0, dot));
+        if (id < 0)
+            return false;
+
+        TuneItem& item = *m_container.get(id);
+        if (item.type != TUNING_TYPE_STRUCT)
+            return false;
+        String name = label.substring(dot + 1);
+        for (size_t i = 0; i < item.layout->count; i++) {
+            const TuneField& field = item.layout->fields[i];
+            if (name == field.name) {
+                ref.id = id;
+                ref.type = field.type;
+                ref.data = field_data(item.data, field);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    /**
+     * Runs the bookkeeping and callback after a command modifies a value.
+     */
+    void updated(const Ref& ref)
+    {
+        markChanged(ref.id);
+        if (m_onSetCallback)
+            m_onSetCallback(ref.data);
+    }
+
+    Ref refer(int id)
+    {
+        TuneItem& item = *m_container.get(id);
+        Ref ref;
+        ref.id = id;
+        ref.type = item.type;
+        ref.data = item.data;
+        ref.layout = item.type == TUNING_TYPE_STRUCT ? item.layout : nullptr;
+        ref.size = item.type == TUNING_TYPE_BLOB ? item.size : 0;
+        return ref;
+    }
+
+    static void* field_data(void* instance, const TuneField& field)
+    {
+        return reinterpret_cast<uint8_t*>(instance) + field.offset;
+    }
+
+    /**
+     * Assigns comma-separated values to a struct's fields, in order. Empty
+     * values leave the field unchanged.
+     */
+    void setFields(const Ref& ref, const String& value)
+    {
+        detail::StringReader reader{value};
+        for (size_t i = 0; i < ref.layout->count && reader; i++) {
+            const TuneField& field = ref.layout->fields[i];
+            String v = reader.readUntil(',');
+            if (!v.isEmpty())
+                set(field.type, field_data(ref.data, field), v);
+        }
+    }
+
+    /**
+     * Prints an item, or each field of a struct as "label.field=value".
+     */
+    void print(const String& label, const Ref& ref, Print& out)
+    {
+        if (ref.type == TUNING_TYPE_BLOB) {
+            // Blobs are summarised as "size,crc32" rather than dumped.
+            uint32_t crc = detail::crc32(reinterpret_cast<const uint8_t*>(ref.data), ref.size);
+            out.printf(SERIAL_TUNING_OUTPUT_FORMAT, label.c_str(), (String(ref.size) + "," + hex(crc)).c_str());
+            return;
+        }
+        if (!ref.layout) {
+            out.printf(SERIAL_TUNING_OUTPUT_FORMAT, label.c_str(), to_string(ref.type, ref.data).c_str());
+            return;
+        }
+        for (size_t i = 0; i < ref.layout->count; i++) {
+            const TuneField& field = ref.layout->fields[i];
+            out.printf(SERIAL_TUNING_OUTPUT_FORMAT, (label + "." + field.name).c_str(),
+                       to_string(field.type, field_data(ref.data, field)).c_str());
+        }
+    }
+
+    /**
+     * Starts a ramp from a "label~target@duration[,exp]" command. The
+     * duration is in ms, or in seconds with an "s" suffix. A new ramp on the
+     * same variable replaces the old one.
+     */
+    void startRamp(const String& command, Print& out)
+    {
+#ifndef SERIAL_TUNING_WARN_INVALID
+        (void)out; // Only used for warnings.
+#endif
+        detail::StringReader reader{command};
+        String label = reader.readUntil('~');
+        String target = reader.readUntil('@');
+        String duration = reader.readUntil(',');
+        String mode = reader.rest();
+
+        const char* str = duration.c_str();
+        char* str_end;
+        double ms = strtod(str, &str_end);
+        if (strcmp(str_end, "s") == 0)
+            ms *= 1000;
+        else if (*str_end && strcmp(str_end, "ms") != 0)
+            str_end = const_cast<char*>(str);
+
+        // Durations are compared against millis() differences, which wrap. This also rejects NaN.
+        bool inRange = ms >= 0 && ms <= std::numeric_limits<unsigned long>::max() / 2;
+
+        Ref ref;
+        double from, to;
+        if (str_end == str || !inRange || !(mode.isEmpty() || mode == "lin" || mode == "exp") || !resolve(label, ref)
+            || ref.layout || !get_number(ref.type, ref.data, from) || !parse_number(ref.type, target, to)) {
+#ifdef SERIAL_TUNING_WARN_INVALID
+            out.println("[TuneSet] error: invalid ramp '" + command + "'");
+#endif
+            return;
+        }
+
+        cancelRamps(ref);
+        for (detail::Ramp& ramp : m_ramps) {
+            if (ramp.id < 0) {
+                ramp.id = ref.id;
+                ramp.type = ref.type;
+                ramp.data = ref.data;
+                ramp.from = from;
+                ramp.to = to;
+                ramp.start = millis();
+                ramp.duration = static_cast<unsigned long>(ms);
+                ramp.exponential = mode == "exp";
+                return;
+            }
+        }
+#ifdef SERIAL_TUNING_WARN_INVALID
+        out.println("[TuneSet] error: too many ramps");
+#endif
+    }
+
+    /**
+     * Stops ramps on whatever `ref` refers to. For a whole struct, that's any
+     * of its fields.
+     */
+    void cancelRamps(const Ref& ref)
+    {
+        for (detail::Ramp& ramp : m_ramps) {
+            if (ramp.id == ref.id && (ref.layout || ramp.data == ref.data))
+                ramp.id = -1;
+        }
+    }
+
+    static String hex(uint32_t value)
+    {
+        char buffer[9];
+        snprintf(buffer, sizeof(buffer), "%08lx", static_cast<unsigned long>(value));
+        return String(buffer);
+    }
+
+    /**
+     * Starts an upload from a "label<length,crc32" header. The length is in
+     * bytes and may be smaller than the blob. The checksum is in hex.
+     */
+    void upload(const String& header, Print& out)
+    {
+        int lt = header.indexOf('<');
+        String label = header.substring(0, lt);
+        const char* str = header.c_str() + lt + 1;
+        char* str_end;
+        size_t length = strtoul(str, &str_end, 10);
+        bool ok = str_end != str && *str_end == ',';
+        uint32_t crc = ok ? strtoul(str_end + 1, &str_end, 16) : 0;
+        ok = ok && *str_end == '\0';
+
+        Ref ref;
+        if (!ok || !resolve(label, ref) || ref.type != TUNING_TYPE_BLOB || length == 0 || length > ref.size) {
+#ifdef SERIAL_TUNING_WARN_INVALID
+            out.println("[TuneSet] error: invalid upload '" + header + "'");
+#endif
+            return;
+        }
+        if (m_upload.active()) {
+#ifdef SERIAL_TUNING_WARN_INVALID
+            out.println("[TuneSet] error: another upload is in progress");
+#endif
+            return;
+        }
+
+        m_upload.begin(ref.id, reinterpret_cast<uint8_t*>(ref.data), length, crc);
+        m_uploadClient = &out;
+        m_uploadTime = millis();
+    }
+
+    /**
+     * Moves available upload data from the stream into the blob.
+     */
+    void receive(Stream& stream)
+    {
+#ifdef SERIAL_TUNING_BLOB_RAW
+        size_t n = stream.available();
+        if (n > m_upload.remaining())
+            n = m_upload.remaining();
+        m_upload.commit(stream.readBytes(m_upload.cursor(), n));
+#else
+        while (stream.available() && !m_upload.complete())
+            m_upload.decode(stream.read());
+#endif
+        m_uploadTime = millis();
+        if (m_upload.complete())
+            finishUpload();
+    }
+
+    void finishUpload()
+    {
+        // Reply with the header, carrying the checksum of what was received.
+        int id = m_upload.id();
+        const String& label = m_container.label(id);
+        m_uploadClient->printf("%s<%u,%s\n", label.c_str(), static_cast<unsigned>(m_upload.size()),
+                               hex(m_upload.checksum()).c_str());
+        if (m_upload.valid()) {
+            updated(refer(id));
+            m_upload.end();
+        } else {
+#ifdef SERIAL_TUNING_WARN_INVALID
+            m_uploadClient->println("[TuneSet] error: checksum mismatch in upload to '" + label + "'");
+#endif
+            abortUpload();
+        }
+    }
+
+    /**
+     * Ends a failed upload. Whatever was received has already been written to
+     * the blob, so it's still marked as changed, but the update callback isn't
+     * called.
+     */
+    void abortUpload()
+    {
+        if (m_upload.received() > 0)
+            markChanged(m_upload.id());
+        m_upload.end();
+    }
+
+    /**
+     * Handles built-in commands. Registered labels take precedence, so these
+     * are only reached when no item matches.
+     */
+    bool command(const String& name, const String& value, Print& out)
+    {
+        if (name == "schema") {
+            printSchema(out);
+            return true;
+        }
+        if (name == "changed") {
+            printChanged(strtoul(value.c_str(), nullptr, 10), out);
+            return true;
+        }
+        return false;
+    }
+
+    /**
+     * Prints a header line with the number of lines to follow, then one line
+     * per item. Structs are followed by one line per field, with the struct's
+     * ID and a "label.field" label.
+     */
+    void printSchema(Print& out)
+    {
+        size_t lines = m_container.size();
+        for (size_t id = 0; id < m_container.size(); id++) {
+            TuneItem& item = *m_container.get(id);
+            if (item.type == TUNING_TYPE_STRUCT)
+                lines += item.layout->count;
+        }
+
+        out.printf(SERIAL_TUNING_OUTPUT_FORMAT, "schema", String(lines).c_str());
+        for (size_t id = 0; id < m_container.size(); id++) {
+            TuneItem& item = *m_container.get(id);
+            const String& label = m_container.label(id);
+            printSchemaLine(id, label, item.type, out);
+            if (item.type == TUNING_TYPE_STRUCT) {
+                for (size_t i = 0; i < item.layout->count; i++) {
+                    const TuneField& field = item.layout->fields[i];
+                    printSchemaLine(id, label + "." + field.name, field.type, out);
+                }
+            }
+        }
+    }
+
+    void printSchemaLine(size_t id, const String& label, Type type, Print& out)
+    {
+        String min, max;
+        bounds(type, min, max);
+        out.printf(SERIAL_TUNING_SCHEMA_FORMAT, static_cast<unsigned>(id), label.c_str(), type_name(type), min.c_str(),
+                   max.c_str());
+    }
+
+    /**
+     * Prints items changed after generation `since`, followed by a
+     * "changed=<generation>" line which the client passes back next time.
+     */
+    void printChanged(uint32_t since, Print& out)
+    {
+#ifdef SERIAL_TUNING_SHADOW_COPY
+        // Pick up values which the firmware changed without calling markChanged().
+        for (size_t id = 0; id < m_container.size(); id++) {
+            if (snapshot(*m_container.get(id), m_shadow[id]))
+                m_changed[id] = ++m_generation;
+        }
+#endif
+        for (size_t id = 0; id < m_container.size(); id++) {
+            if (m_changed[id] > since)
+                print(m_container.label(id), refer(id), out);
+        }
+        out.printf(SERIAL_TUNING_OUTPUT_FORMAT, "changed", String(m_generation).c_str());
+    }
+
+#ifdef SERIAL_TUNING_SHADOW_COPY
+    /**
+     * Copies the item's current value into its shadow. Returns true if the
+     * value differs from the shadow. Only arithmetic types are shadowed.
+     */
+    static bool snapshot(TuneItem& item, uint64_t& shadow)
     {
         switch (item.type) {
 #define X_CASE(T) \
-    case ENUMIFY(T): *reinterpret_cast<T*>(item.data) = Reader::template read<T>(value); break;
+    case ENUMIFY(T): return snapshot<T>(item.data, shadow);
 
             SERIAL_TUNING_TYPE_LIST(X_CASE)
 
 #undef X_CASE
+            default: break;
         }
+        return false;
     }
 
-    String to_string(TuneItem& item)
+    template <typename T, ENABLE_IF(std::is_arithmetic<T>::value && sizeof(T) <= sizeof(uint64_t))>
+    static bool snapshot(const void* data, uint64_t& shadow)
     {
-        switch (item.type) {
+        uint64_t current = 0;
+        memcpy(&current, data, sizeof(T));
+        bool changed = current != shadow;
+        shadow = current;
+        return changed;
+    }
+
+    template <typename T, ENABLE_IF(!(std::is_arithmetic<T>::value && sizeof(T) <= sizeof(uint64_t)))>
+    static bool snapshot(const void*, uint64_t&)
+    {
+        return false;
+    }
+#endif
+
+    static const char* type_name(Type type)
+    {
+        switch (type) {
+#define X_CASE(T) \
+    case ENUMIFY(T): return #T;
+
+            SERIAL_TUNING_TYPE_LIST(X_CASE)
+
+#undef X_CASE
+            case TUNING_TYPE_STRUCT: return "struct";
+            case TUNING_TYPE_BLOB: return "blob";
+        }
+        return "";
+    }
+
+    static void bounds(Type type, String& min, String& max)
+    {
+        switch (type) {
+#define X_CASE(T) \
+    case ENUMIFY(T): bounds<T>(min, max); break;
+
+            SERIAL_TUNING_TYPE_LIST(X_CASE)
+
+#undef X_CASE
+            default: break;
+        }
+    }
+
+    // Only integers have bounds worth reporting. Other types are left empty.
+    template <typename T, ENABLE_IF(std::is_integral<T>::value)>
+    static void bounds(String& min, String& max)
+    {
+        min = Writer::template write<T>(std::numeric_limits<T>::min());
+        max = Writer::template write<T>(std::numeric_limits<T>::max());
+    }
+
+    template <typename T, ENABLE_IF(!std::is_integral<T>::value)>
+    static void bounds(String&, String&)
+    {
+    }
+
+    static void set(Type type, void* data, const String& value)
+    {
+        switch (type) {
+#define X_CASE(T) \
+    case ENUMIFY(T): *reinterpret_cast<T*>(data) = Reader::template read<T>(value); break;
+
+            SERIAL_TUNING_TYPE_LIST(X_CASE)
+
+#undef X_CASE
+            default: break;
+        }
+    }
+
+    /**
+     * Reads a numeric variable as a double. Returns false for other types.
+     */
+    static bool get_number(Type type, void* data, double& value)
+    {
+        switch (type) {
+#define X_CASE(T) \
+    case ENUMIFY(T): return get_number<T>(*reinterpret_cast<T*>(data), value);
+
+            SERIAL_TUNING_TYPE_LIST(X_CASE)
+
+#undef X_CASE
+            default: break;
+        }
+        return false;
+    }
+
+    /**
+     * Parses a value of a numeric variable's type, as a double.
+     */
+    static bool parse_number(Type type, const String& str, double& value)
+    {
+        switch (type) {
+#define X_CASE(T) \
+    case ENUMIFY(T): return get_number<T>(Reader::template read<T>(str), value);
+
+            SERIAL_TUNING_TYPE_LIST(X_CASE)
+
+#undef X_CASE
+            default: break;
+        }
+        return false;
+    }
+
+    /**
+     * Sets a numeric variable from a double. Returns whether its value changed.
+     */
+    static bool set_number(Type type, void* data, double value)
+    {
+        switch (type) {
+#define X_CASE(T) \
+    case ENUMIFY(T): return set_number<T>(*reinterpret_cast<T*>(data), value);
+
+            SERIAL_TUNING_TYPE_LIST(X_CASE)
+
+#undef X_CASE
+            default: break;
+        }
+        return false;
+    }
+
+    template <typename T, ENABLE_IF(std::is_arithmetic<T>::value)>
+    static bool get_number(const T& data, double& value)
+    {
+        value = static_cast<double>(data);
+        return true;
+    }
+
+    template <typename T, ENABLE_IF(!std::is_arithmetic<T>::value)>
+    static bool get_number(const T&, double&)
+    {
+        return false;
+    }
+
+    template <typename T, ENABLE_IF(std::is_integral<T>::value)>
+    static bool set_number(T& data, double value)
+    {
+        T old = data;
+        data = static_cast<T>(value < 0 ? value - 0.5 : value + 0.5);
+        return data != old;
+    }
+
+    template <typename T, ENABLE_IF(std::is_floating_point<T>::value)>
+    static bool set_number(T& data, double value)
+    {
+        T old = data;
+        data = static_cast<T>(value);
+        return data != old;
+    }
+
+    template <typename T, ENABLE_IF(!std::is_arithmetic<T>::value)>
+    static bool set_number(T&, double)
+    {
+        return false;
+    }
+
+    static bool is_operator(char c)
+    {
+        return c && strchr("+-*/%&|^", c);
+    }
+
+    /**
+     * Whether `str` is a whole integer, such as "-12" or "0x1f".
+     */
+    static bool is_integer(const String& str)
+    {
+        char* str_end;
+        strtoll(str.c_str(), &str_end, 0);
+        return str_end != str.c_str() && *str_end == '\0';
+    }
+
+    /**
+     * Whether all of `str` is a number, such as "1.5" or "-2e3".
+     */
+    static bool is_number(const String& str)
+    {
+        char* str_end;
+        strtod(str.c_str(), &str_end);
+        return str_end != str.c_str() && *str_end == '\0';
+    }
+
+    /**
+     * Applies `data op= value`. Returns false if the operator isn't supported
+     * by the type, on a malformed operand (or a non-integer one for an integer
+     * type), or on integer overflow or division by zero.
+     */
+    static bool apply(Type type, void* data, char op, const String& value)
+    {
+        switch (type) {
 #define X_CASE(T) \
-    case ENUMIFY(T): return Writer::template write<T>(*reinterpret_cast<T*>(item.data));
+    case ENUMIFY(T): return apply<T>(*reinterpret_cast<T*>(data), op, value);
 
             SERIAL_TUNING_TYPE_LIST(X_CASE)
 
 #undef X_CASE
+            default: break;
+        }
+        return false;
+    }
+
+    template <typename T, ENABLE_IF(std::is_integral<T>::value)>
+    static bool apply(T& data, char op, const String& value)
+    {
+        // Otherwise "x*=1.5" would quietly multiply by 1.
+        if (!is_integer(value))
+            return false;
+
+        T operand = Reader::template read<T>(value);
+        T result;
+        bool ok = true;
+        switch (op) {
+            // Results which don't fit in T are rejected rather than wrapped.
+            case '+': ok = !__builtin_add_overflow(data, operand, &result); break;
+            case '-': ok = !__builtin_sub_overflow(data, operand, &result); break;
+            case '*': ok = !__builtin_mul_overflow(data, operand, &result); break;
+            case '/':
+            case '%':
+                // MIN / -1 overflows too.
+                ok = operand != 0
+                     && !(std::is_signed<T>::value && data == std::numeric_limits<T>::min() && operand == T(-1));
+                if (ok)
+                    result = op == '/' ? data / operand : data % operand;
+                break;
+            case '&': result = data & operand; break;
+            case '|': result = data | operand; break;
+            case '^': result = data ^ operand; break;
+            default: return false;
+        }
+        if (ok)
+            data = result;
+        return ok;
+    }
+
+    template <typename T, ENABLE_IF(std::is_floating_point<T>::value)>
+    static bool apply(T& data, char op, const String& value)
+    {
+        // Otherwise a typo such as "kp*=abc" would multiply by 0.
+        if (!is_number(value))
+            return false;
+
+        T operand = Reader::template read<T>(value);
+        switch (op) {
+            case '+': data += operand; break;
+            case '-': data -= operand; break;
+            case '*': data *= operand; break;
+            case '/': data /= operand; break;
+            default: return false;
+        }
+        return true;
+    }
+
+    template <typename T, ENABLE_IF(!std::is_arithmetic<T>::value)>
+    static bool apply(T&, char, const String&)
+    {
+        return false;
+    }
+
+    static String to_string(Type type, void* data)
+    {
+        switch (type) {
+#define X_CASE(T) \
+    case ENUMIFY(T): return Writer::template write<T>(*reinterpret_cast<T*>(data));
+
+            SERIAL_TUNING_TYPE_LIST(X_CASE)
+
+#undef X_CASE
+            default: break;
         }
         return "";
     }
@@ -399,5 +1539,18 @@ private:
 // Helper macro for adding a tuning variable with the same label as the variable name.
 #define TUNE(VAR) add(#VAR, VAR)
 
+// Describes a field of the struct passed to TUNE_STRUCT, e.g. TUNE_FIELD(kp).
+#define TUNE_FIELD(FIELD) \
+    TuneField{#FIELD, offsetof(TuneFieldStruct, FIELD), detail::type_of<decltype(TuneFieldStruct::FIELD)>::value}
+
+// Declares a TuneStructOf<STRUCT> constant named NAME from a list of TUNE_FIELDs. Use at namespace scope.
+#define TUNE_STRUCT(NAME, STRUCT, ...)            \
+    namespace NAME##_layout                       \
+    {                                             \
+        using TuneFieldStruct = STRUCT;           \
+        const TuneField fields[] = {__VA_ARGS__}; \
+    }                                             \
+    const TuneStructOf<STRUCT> NAME{NAME##_layout::fields, sizeof(NAME##_layout::fields) / sizeof(TuneField)}
+
 
 #endif
@@ -0,0 +1,317 @@
+// Native (POSIX) backend for Serial Tuning. Provides the subset of the Arduino
+// core which tuning.h uses, so that the same TuneSet code runs in firmware and
+// in a simulator on Linux. `String` wraps std::string, and `Stream`s read and
+// write file descriptors.
+//
+// tuning.h includes this automatically when <Arduino.h> isn't available. You
+// can also force it by defining SERIAL_TUNING_NATIVE. Requires C++17.
+
+#ifndef SERIAL_TUNING_NATIVE_H
+#define SERIAL_TUNING_NATIVE_H
+
+// Serial must be an inline variable, so that every translation unit shares it.
+#if __cplusplus < 201703L
+#error "The native backend requires C++17."
+#endif
+
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <cstdarg>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <type_traits>
+
+
+inline unsigned long millis()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000UL + ts.tv_nsec / 1000000UL;
+}
+
+inline void delay(unsigned long ms)
+{
+    usleep(ms * 1000);
+}
+
+
+class String
+{
+public:
+    String() = default;
+    String(const char* s) : m_str{s ? s : ""} {}
+    String(const std::string& s) : m_str{s} {}
+    explicit String(char c) : m_str(1, c) {}
+
+    template <typename T, typename std::enable_if<std::is_integral<T>::value, int>::type = 0>
+    String(T value, unsigned char base = 10)
+    {
+        char buffer[72];
+        if (base == 16)
+            snprintf(buffer, sizeof(buffer), "%llx", static_cast<unsigned long long>(value));
+        else if (std::is_signed<T>::value)
+            snprintf(buffer, sizeof(buffer), "%lld", static_cast<long long>(value));
+        else
+            snprintf(buffer, sizeof(buffer), "%llu", static_cast<unsigned long long>(value));
+        m_str = buffer;
+    }
+
+    String(double value, unsigned char decimals = 2)
+    {
+        char buffer[64];
+        snprintf(buffer, sizeof(buffer), "%.*f", decimals, value);
+        m_str = buffer;
+    }
+
+    const char* c_str() const { return m_str.c_str(); }
+    unsigned int length() const { return m_str.size(); }
+    bool isEmpty() const { return m_str.empty(); }
+    char operator[](unsigned int i) const { return i < m_str.size() ? m_str[i] : '\0'; }
+    const char* begin() const { return m_str.data(); }
+    const char* end() const { return m_str.data() + m_str.size(); }
+
+    String substring(unsigned int begin) const { return substring(begin, m_str.size()); }
+    String substring(unsigned int begin, unsigned int end) const
+    {
+        if (end > m_str.size())
+            end = m_str.size();
+        if (begin >= end)
+            return String();
+        return m_str.substr(begin, end - begin);
+    }
+
+    int indexOf(char c, unsigned int from = 0) const
+    {
+        size_t i = m_str.find(c, from);
+        return i == std::string::npos ? -1 : static_cast<int>(i);
+    }
+
+    long toInt() const { return atol(m_str.c_str()); }
+    float toFloat() const { return atof(m_str.c_str()); }
+
+    void trim()
+    {
+        size_t begin = m_str.find_first_not_of(" \t\r\n");
+        size_t end = m_str.find_last_not_of(" \t\r\n");
+        m_str = begin == std::string::npos ? "" : m_str.substr(begin, end - begin + 1);
+    }
+
+    String& operator+=(const String& other)
+    {
+        m_str += other.m_str;
+        return *this;
+    }
+    String& operator+=(char c)
+    {
+        m_str += c;
+        return *this;
+    }
+
+    friend String operator+(String lhs, const String& rhs) { return lhs += rhs; }
+    friend bool operator==(const String& lhs, const String& rhs) { return lhs.m_str == rhs.m_str; }
+    friend bool operator!=(const String& lhs, const String& rhs) { return lhs.m_str != rhs.m_str; }
+
+private:
+    std::string m_str;
+};
+
+
+class Print
+{
+public:
+    virtual ~Print() = default;
+    virtual size_t write(const uint8_t* buffer, size_t size) = 0;
+
+    size_t write(uint8_t c) { return write(&c, 1); }
+    size_t print(const char* s) { return write(reinterpret_cast<const uint8_t*>(s), strlen(s)); }
+    size_t print(const String& s) { return write(reinterpret_cast<const uint8_t*>(s.c_str()), s.length()); }
+    size_t println(const char* s) { return print(s) + print("\n"); }
+    size_t println(const String& s) { return print(s) + print("\n"); }
+
+    size_t printf(const char* format, ...) __attribute__((format(printf, 2, 3)))
+    {
+        char buffer[256];
+        va_list args;
+        va_start(args, format);
+        int n = vsnprintf(buffer, sizeof(buffer), format, args);
+        va_end(args);
+        if (n < 0)
+            return 0;
+        if (static_cast<size_t>(n) < sizeof(buffer))
+            return write(reinterpret_cast<const uint8_t*>(buffer), n);
+
+        std::string big(n + 1, '\0');
+        va_start(args, format);
+        vsnprintf(&big[0], big.size(), format, args);
+        va_end(args);
+        return write(reinterpret_cast<const uint8_t*>(big.data()), n);
+    }
+};
+
+
+class Stream : public Print
+{
+public:
+    virtual int available() = 0;
+    virtual int read() = 0;
+    virtual int peek() = 0;
+
+    void setTimeout(unsigned long timeout) { m_timeout = timeout; }
+
+    // Same semantics as Arduino: stops at the delimiter (consumed, not
+    // returned) or after the timeout elapses with no further data.
+    String readStringUntil(char terminator)
+    {
+        String s;
+        for (;;) {
+            int c = timedRead();
+            if (c < 0 || c == terminator)
+                break;
+            s += static_cast<char>(c);
+        }
+        return s;
+    }
+
+    size_t readBytes(uint8_t* buffer, size_t length)
+    {
+        size_t n = 0;
+        for (int c; n < length && (c = timedRead()) >= 0; n++)
+            buffer[n] = c;
+        return n;
+    }
+
+    size_t readBytes(char* buffer, size_t length)
+    {
+        return readBytes(reinterpret_cast<uint8_t*>(buffer), length);
+    }
+
+protected:
+    virtual bool wait(unsigned long timeout) = 0;
+
+    int timedRead()
+    {
+        unsigned long start = millis();
+        for (;;) {
+            if (available())
+                return read();
+            unsigned long elapsed = millis() - start;
+            if (elapsed >= m_timeout || !wait(m_timeout - elapsed))
+                return -1;
+        }
+    }
+
+    unsigned long m_timeout = 1000;
+};
+
+
+#ifndef SERIAL_TUNING_NATIVE_BUFFER_SIZE
+#define SERIAL_TUNING_NATIVE_BUFFER_SIZE 512
+#endif
+
+
+/**
+ * A Stream over a pair of file descriptors (which may be the same, e.g. a
+ * socket or pty), buffering reads. Reads never block for longer than the
+ * stream's timeout. Writes to a non-blocking descriptor drop what doesn't fit.
+ */
+class FdStream : public Stream
+{
+public:
+    FdStream() = default;
+    FdStream(int in, int out) : m_in{in}, m_out{out} {}
+
+    void begin(int in, int out)
+    {
+        m_in = in;
+        m_out = out;
+        m_begin = m_end = 0;
+        m_eof = false;
+    }
+
+    void begin(int fd) { begin(fd, fd); }
+
+    int fd() const { return m_in; }
+    int outFd() const { return m_out; }
+
+    // Whether the input has reached end of file, or failed.
+    bool eof() const { return m_eof; }
+
+    int available() override
+    {
+        if (m_begin == m_end)
+            fill(0);
+        return m_end - m_begin;
+    }
+
+    int read() override { return available() ? m_buffer[m_begin++] : -1; }
+    int peek() override { return available() ? m_buffer[m_begin] : -1; }
+
+    size_t write(const uint8_t* buffer, size_t size) override
+    {
+        size_t written = 0;
+        while (m_out >= 0 && written < size) {
+            ssize_t n = ::write(m_out, buffer + written, size - written);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                break;
+            written += n;
+        }
+        return written;
+    }
+
+    using Print::write;
+
+    /**
+     * Reads whatever the descriptor has ready into the buffer, waiting up to
+     * `timeout` ms. Returns false on timeout, error, or end of file.
+     */
+    bool fill(unsigned long timeout)
+    {
+        if (m_begin > 0) {
+            memmove(m_buffer, m_buffer + m_begin, m_end - m_begin);
+            m_end -= m_begin;
+            m_begin = 0;
+        }
+
+        pollfd pfd{m_in, POLLIN, 0};
+        if (m_in < 0 || m_end == sizeof(m_buffer) || ::poll(&pfd, 1, timeout) <= 0)
+            return false;
+        ssize_t n = ::read(m_in, m_buffer + m_end, sizeof(m_buffer) - m_end);
+        if (n <= 0) {
+            m_eof = n == 0 || (errno != EAGAIN && errno != EINTR);
+            return false;
+        }
+        m_end += n;
+        return true;
+    }
+
+protected:
+    bool wait(unsigned long timeout) override { return fill(timeout); }
+
+    size_t buffered() const { return m_end - m_begin; }
+    const uint8_t* data() const { return m_buffer + m_begin; }
+    bool full() const { return m_begin == 0 && m_end == sizeof(m_buffer); }
+    void skip(size_t n) { m_begin += n < buffered() ? n : buffered(); }
+
+private:
+    int m_in = -1;
+    int m_out = -1;
+    uint8_t m_buffer[SERIAL_TUNING_NATIVE_BUFFER_SIZE];
+    size_t m_begin = 0;
+    size_t m_end = 0;
+    bool m_eof = false;
+};
+
+
+// The default port is the process's stdin/stdout.
+inline FdStream Serial{STDIN_FILENO, STDOUT_FILENO};
+
+
+#endif
@@ -49,16 +49,44 @@
 // #include "your-custom-type-defs.h"
 
 
+// ----- Change Tracking -----
+// Uncomment the following line to detect changes which the firmware makes to integer/floating-point variables, by
+// comparing against a shadow copy whenever the "changed" command is received. Costs 8 bytes per item.
+// #define SERIAL_TUNING_SHADOW_COPY
+
+
+// ----- Blob Uploads -----
+// Uncomment the following line to upload blobs as raw bytes instead of base64. Raw uploads must be read through
+// readSerial().
+// #define SERIAL_TUNING_BLOB_RAW
+
+// The time (in milliseconds) after which a stalled upload is abandoned.
+// #define SERIAL_TUNING_UPLOAD_TIMEOUT 1000
+
+
+// ----- Ramps -----
+// The maximum number of ramps ("label~value@duration") which can run at once.
+// #define SERIAL_TUNING_MAX_RAMPS 4
+
+
 // ----- Serial Output -----
 
 // Uncomment the following line to print warnings to Serial when a variable name is not found.
 // #define SERIAL_TUNING_WARN_NOT_FOUND
 
+// Uncomment the following line to print warnings to Serial when a command can't be applied (e.g. an unsupported
+// operator such as "name+=x" on a String, or integer division by zero).
+// #define SERIAL_TUNING_WARN_INVALID
+
 // Uncomment the following line to log the name/value parsed by TuneSet.
 // #define SERIAL_TUNING_LOG_PARSE_RESULT
 
 // Uncomment the following line to change the output format when "getting" variables (i.e. commands which don't set
 // values). #define SERIAL_TUNING_OUTPUT_FORMAT "%s=%s\n"
 
+// Uncomment the following line to change the format of each line printed by the "schema" command.
+// The arguments are: id (unsigned), label, type, min, max.
+// #define SERIAL_TUNING_SCHEMA_FORMAT "%u,%s,%s,%s,%s\n"
+
 
 #endif
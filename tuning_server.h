@@ -0,0 +1,401 @@
+// Serves a TuneSet to many clients at once on Linux, using epoll. Clients can
+// connect over a UNIX socket or a pty, or be attached as existing descriptors
+// (e.g. stdin/stdout). Call poll() from the simulation loop: it handles
+// whatever input is ready and returns without blocking.
+//
+// Requires the native backend (see tuning_native.h).
+
+#ifndef SERIAL_TUNING_SERVER_H
+#define SERIAL_TUNING_SERVER_H
+
+#include "tuning.h"
+
+#include <fcntl.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <termios.h>
+#include <unistd.h>
+
+
+#ifndef SERIAL_TUNING_SERVER_MAX_CLIENTS
+#define SERIAL_TUNING_SERVER_MAX_CLIENTS 8
+#endif
+
+// Clients whose unsent replies exceed this many bytes are disconnected. Input from a client is paused while half of
+// this is queued.
+#ifndef SERIAL_TUNING_SERVER_MAX_OUTPUT
+#define SERIAL_TUNING_SERVER_MAX_OUTPUT 65536
+#endif
+
+
+template <typename Tuning, size_t MAX_CLIENTS = SERIAL_TUNING_SERVER_MAX_CLIENTS>
+class TuneServer
+{
+    /**
+     * A connected client. Only complete lines are reported as available, so
+     * that a partial command is never parsed before the rest arrives. Replies
+     * are queued, and sent as the client's descriptor can take them. No input
+     * is available while too many replies are queued.
+     */
+    class Client : public FdStream
+    {
+    public:
+        const Tuning* tuning = nullptr;
+        bool owned = false;     // Whether the server opened the descriptor, and should close it.
+        uint32_t inEvents = 0;  // What the server waits for on the input descriptor.
+        uint32_t outEvents = 0; // What the server waits for on a separate output descriptor.
+
+        void begin(int in, int out)
+        {
+            FdStream::begin(in, out);
+            m_lines = 0;
+            m_discarding = false;
+            m_output.clear();
+            m_overflowed = false;
+            inEvents = EPOLLIN | EPOLLRDHUP;
+            outEvents = 0;
+        }
+
+        /**
+         * Reads whatever is ready, and finds where the last complete line
+         * ends. A line which doesn't fit in the buffer is discarded, up to
+         * its newline.
+         */
+        void receive()
+        {
+            fill(0);
+            if (m_discarding) {
+                const uint8_t* newline = static_cast<const uint8_t*>(memchr(data(), '\n', buffered()));
+                m_discarding = !newline;
+                skip(newline ? newline - data() + 1 : buffered());
+            }
+
+            const uint8_t* newline = static_cast<const uint8_t*>(memrchr(data(), '\n', buffered()));
+            m_lines = newline ? newline - data() + 1 : 0;
+            if (!newline && full() && !tuning->uploading(*this)) {
+#ifdef SERIAL_TUNING_WARN_INVALID
+                println("[TuneSet] error: line too long");
+#endif
+                skip(buffered());
+                m_discarding = true;
+            }
+        }
+
+        int available() override
+        {
+            if (backedUp())
+                return 0;
+            // Upload data isn't line-based.
+            if (tuning->uploading(*this))
+                return buffered();
+            return m_lines;
+        }
+
+        int read() override
+        {
+            int c = available() ? FdStream::read() : -1;
+            if (c >= 0 && m_lines > 0)
+                m_lines--;
+            return c;
+        }
+
+        int peek() override
+        {
+            return available() ? FdStream::peek() : -1;
+        }
+
+        size_t write(const uint8_t* buffer, size_t size) override
+        {
+            if (m_overflowed || m_output.size() + size > SERIAL_TUNING_SERVER_MAX_OUTPUT) {
+                m_overflowed = true;
+                return 0;
+            }
+            m_output.append(reinterpret_cast<const char*>(buffer), size);
+            return size;
+        }
+
+        using Print::write;
+
+        /**
+         * Sends as much queued output as the descriptor takes without
+         * blocking. Blocking descriptors (e.g. stdout) are only written when
+         * poll() reports room, at most PIPE_BUF bytes at a time.
+         *
+         * @return  false if the queue overflowed or the descriptor failed.
+         */
+        bool flush()
+        {
+            while (!m_overflowed && !m_output.empty()) {
+                pollfd pfd{outFd(), POLLOUT, 0};
+                if (::poll(&pfd, 1, 0) <= 0)
+                    return true;
+                if (pfd.revents & (POLLERR | POLLHUP) || !(pfd.revents & POLLOUT))
+                    return false;
+
+                size_t size = m_output.size() < PIPE_BUF ? m_output.size() : PIPE_BUF;
+                ssize_t n = ::write(outFd(), m_output.data(), size);
+                if (n < 0)
+                    return errno == EAGAIN || errno == EINTR;
+                m_output.erase(0, n);
+            }
+            return !m_overflowed;
+        }
+
+        bool pending() const
+        {
+            return !m_output.empty();
+        }
+
+        bool backedUp() const
+        {
+            return m_output.size() >= SERIAL_TUNING_SERVER_MAX_OUTPUT / 2;
+        }
+
+    private:
+        size_t m_lines = 0;        // Bytes up to the end of the last complete line.
+        bool m_discarding = false; // Whether the rest of an overlong line is being skipped.
+        std::string m_output;      // Replies which haven't been sent yet.
+        bool m_overflowed = false;
+    };
+
+public:
+    TuneServer(Tuning& tuning) : m_tuning{tuning}, m_epoll{epoll_create1(EPOLL_CLOEXEC)}
+    {
+        for (Client& client : m_clients)
+            client.tuning = &m_tuning;
+    }
+
+    ~TuneServer()
+    {
+        for (size_t i = 0; i < MAX_CLIENTS; i++) {
+            if (m_clients[i].fd() >= 0)
+                disconnect(i);
+        }
+        if (m_listener >= 0) {
+            close(m_listener);
+            unlink(m_path.c_str());
+        }
+        if (m_ptySlave >= 0)
+            close(m_ptySlave);
+        close(m_epoll);
+    }
+
+    TuneServer(const TuneServer&) = delete;
+    TuneServer& operator=(const TuneServer&) = delete;
+
+    /**
+     * @brief   Listens for clients on a UNIX socket at `path`, replacing any
+     *          existing socket file.
+     */
+    bool listen(const char* path)
+    {
+        sockaddr_un addr = {};
+        if (m_listener >= 0 || strlen(path) >= sizeof(addr.sun_path))
+            return false;
+        addr.sun_family = AF_UNIX;
+        strcpy(addr.sun_path, path);
+
+        int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (fd < 0)
+            return false;
+        unlink(path);
+        if (bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0 || ::listen(fd, 4) < 0
+            || !watch(fd, MAX_CLIENTS)) {
+            close(fd);
+            return false;
+        }
+        m_listener = fd;
+        m_path = path;
+        return true;
+    }
+
+    /**
+     * @brief   Opens a pty and serves its master end. Connect to the returned
+     *          device path (e.g. with a serial monitor), or nullptr on failure.
+     */
+    const char* openPty()
+    {
+        if (m_ptySlave >= 0)
+            return nullptr;
+        int master = posix_openpt(O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+        if (master < 0)
+            return nullptr;
+        const char* path = grantpt(master) == 0 && unlockpt(master) == 0 ? ptsname(master) : nullptr;
+
+        // Keep the slave open ourselves, so that the master doesn't hang up
+        // whenever no one else has it open.
+        int slave = path ? ::open(path, O_RDWR | O_NOCTTY | O_CLOEXEC) : -1;
+        if (slave < 0 || add(master, master, true) < 0) {
+            if (slave >= 0)
+                close(slave);
+            close(master);
+            return nullptr;
+        }
+
+        // No echo, no newline translation.
+        termios tio;
+        tcgetattr(slave, &tio);
+        cfmakeraw(&tio);
+        tcsetattr(slave, TCSANOW, &tio);
+        m_ptySlave = slave;
+        return path;
+    }
+
+    /**
+     * @brief   Serves an existing pair of descriptors, such as stdin/stdout.
+     *          They're left open when the client disconnects.
+     *
+     * @return  Whether there was room for another client.
+     */
+    bool attach(int in, int out)
+    {
+        return add(in, out, false) >= 0;
+    }
+
+    /**
+     * @brief   Handles ready input: accepts new clients, and runs complete
+     *          commands through the TuneSet, replying to the client which sent
+     *          them, and advances ramps. Sends queued replies, disconnecting
+     *          clients which fall too far behind. Waits up to `timeout` ms for
+     *          input (default: no waiting).
+     */
+    void poll(int timeout = 0)
+    {
+        // One registration per client for input, one per client whose output goes elsewhere, and the listener.
+        epoll_event events[2 * MAX_CLIENTS + 1];
+        int n = epoll_wait(m_epoll, events, 2 * MAX_CLIENTS + 1, timeout);
+
+        // Tick once for all clients. This also times out stalled uploads, even
+        // when their client has gone quiet.
+        m_tuning.tick();
+        for (int i = 0; i < n; i++) {
+            size_t slot = events[i].data.u64;
+            if (slot == MAX_CLIENTS) {
+                accept();
+                continue;
+            }
+
+            if (slot < MAX_CLIENTS)
+                m_clients[slot].receive();
+        }
+
+        // Every client is checked, since replies may also come from tick() (e.g. when an upload times out), and
+        // buffered commands may have been held back until earlier replies were sent.
+        for (size_t i = 0; i < MAX_CLIENTS; i++) {
+            Client& client = m_clients[i];
+            if (client.fd() < 0)
+                continue;
+            bool ok = client.flush();
+            m_tuning.readCommands(client);
+            ok = ok && client.flush();
+
+            // Let a client which has hung up receive what's left, if it still can.
+            if (!ok || (client.eof() && !client.pending()))
+                disconnect(i);
+            else
+                updateEvents(i);
+        }
+    }
+
+    /**
+     * @brief   The number of connected clients.
+     */
+    size_t clients() const
+    {
+        size_t count = 0;
+        for (const Client& client : m_clients)
+            count += client.fd() >= 0;
+        return count;
+    }
+
+private:
+    bool watch(int fd, size_t slot)
+    {
+        epoll_event event = {};
+        event.events = EPOLLIN | EPOLLRDHUP;
+        event.data.u64 = slot;
+        return epoll_ctl(m_epoll, EPOLL_CTL_ADD, fd, &event) == 0;
+    }
+
+    /**
+     * Waits for a client's input unless its replies are backed up (or it has
+     * hung up), and for its output to become writable while replies are
+     * queued. Output which can't be waited on (e.g. a regular file) is still
+     * flushed on every poll().
+     */
+    void updateEvents(size_t slot)
+    {
+        Client& client = m_clients[slot];
+        uint32_t in = 0, out = 0;
+        if (!client.backedUp() && !client.eof())
+            in = EPOLLIN | EPOLLRDHUP;
+        if (client.pending())
+            out = EPOLLOUT;
+        epoll_event event = {};
+        if (client.outFd() == client.fd()) {
+            in |= out;
+        } else if (out != client.outEvents) {
+            event.events = out;
+            event.data.u64 = MAX_CLIENTS + 1 + slot;
+            if (epoll_ctl(m_epoll, out ? EPOLL_CTL_ADD : EPOLL_CTL_DEL, client.outFd(), &event) == 0 || !out)
+                client.outEvents = out;
+        }
+
+        if (in != client.inEvents) {
+            event.events = in;
+            event.data.u64 = slot;
+            if (epoll_ctl(m_epoll, EPOLL_CTL_MOD, client.fd(), &event) == 0)
+                client.inEvents = in;
+        }
+    }
+
+    int add(int in, int out, bool owned)
+    {
+        for (size_t i = 0; i < MAX_CLIENTS; i++) {
+            Client& client = m_clients[i];
+            if (client.fd() < 0) {
+                if (!watch(in, i))
+                    return -1;
+                client.begin(in, out);
+                client.setTimeout(0);
+                client.owned = owned;
+                return i;
+            }
+        }
+        return -1;
+    }
+
+    void accept()
+    {
+        int fd;
+        while ((fd = accept4(m_listener, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+            if (add(fd, fd, true) < 0)
+                close(fd);
+        }
+    }
+
+    void disconnect(size_t slot)
+    {
+        Client& client = m_clients[slot];
+        m_tuning.cancelUpload(client);
+        if (client.outEvents)
+            epoll_ctl(m_epoll, EPOLL_CTL_DEL, client.outFd(), nullptr);
+        epoll_ctl(m_epoll, EPOLL_CTL_DEL, client.fd(), nullptr);
+        if (client.owned)
+            close(client.fd());
+        client.begin(-1, -1);
+    }
+
+    Tuning& m_tuning;
+    int m_epoll;
+    int m_listener = -1;
+    int m_ptySlave = -1;
+    std::string m_path;
+    Client m_clients[MAX_CLIENTS];
+};
+
+
+#endif